@@ -0,0 +1,113 @@
+/*
+ * File: ScratchBeacon.h
+ *
+ * Multicast announcement of this board to Scratch.
+ * The beacon is rendered once whenever the IP or the module ID changes and
+ * sent every scratch_beacon_period with a random jitter, so that a room of
+ * boards does not send in bursts. A beacon is also sent right after the
+ * WiFi reconnects, but never more often than BEACON_MIN_INTERVAL.
+ */
+
+#ifndef __SCRATCH_BEACON_H__
+#define __SCRATCH_BEACON_H__
+
+#include <ESP8266WiFi.h>
+
+#include "WiFiConfServer.h"
+#include "ScratchClient.h"
+
+#ifndef DEBUG_E4S
+#define DEBUG_E4S(x)
+#endif
+
+#define BEACON_MESSAGE_SIZE 256
+#define BEACON_MIN_INTERVAL 1000U       // ms
+#define BEACON_CAPABILITIES "p2p,multicast,trace,ota"
+#define BEACON_SENSORS "A0,A1,A2,A3,A4,A5,D2"
+
+char beacon_message[BEACON_MESSAGE_SIZE] = {0};
+uint16_t beacon_message_size = 0;
+IPAddress beacon_ip(0U);
+char beacon_module_id[sizeof(WiFiConf.module_id)] = {0};
+bool beacon_connected = false;
+bool beacon_requested = false;
+unsigned long beacon_last_sent = 0;
+unsigned long beacon_delay = 0;
+
+// sensor-update "<id>" "<ip>" "<id>-caps" "<capabilities>" "<id>-sensors" "<sensors>"
+void renderBeacon(void) {
+    beacon_ip = WiFi.localIP();
+    strncpy(beacon_module_id, WiFiConf.module_id, sizeof(beacon_module_id) - 1);
+    int size = snprintf(beacon_message, sizeof(beacon_message),
+            "sensor-update \"%s\" \"%d.%d.%d.%d\" \"%s-caps\" \"%s\" \"%s-sensors\" \"%s\" ",
+            beacon_module_id, beacon_ip[0], beacon_ip[1], beacon_ip[2], beacon_ip[3],
+            beacon_module_id, BEACON_CAPABILITIES,
+            beacon_module_id, BEACON_SENSORS);
+    if (size >= (int)sizeof(beacon_message)) {
+        size = sizeof(beacon_message) - 1;
+    }
+    beacon_message_size = size;
+    // the multicast address follows the subnet of the current IP
+    multi_ip_sta[0] = beacon_ip[0];
+    multi_ip_sta[1] = beacon_ip[1];
+    multi_ip_sta[2] = beacon_ip[2];
+    DEBUG_E4S(String("Beacon rendered: ") + beacon_message);
+}
+
+bool beaconChanged(void) {
+    return (WiFi.localIP() != beacon_ip)
+            || (strncmp(WiFiConf.module_id, beacon_module_id, sizeof(beacon_module_id) - 1) != 0);
+}
+
+unsigned long nextBeaconDelay(void) {
+    long jitter = (long)(scratch_beacon_period / 100) * scratch_beacon_jitter;
+    if (jitter == 0) {
+        return scratch_beacon_period;
+    }
+    return scratch_beacon_period - jitter + random(2 * jitter + 1);
+}
+
+// Sends a beacon as soon as the rate limit allows.
+void requestBeacon(void) {
+    beacon_requested = true;
+}
+
+void setupBeacon(void) {
+    randomSeed(ESP.getChipId() ^ micros());
+    renderBeacon();
+    // setupWiFiConf() has already waited for the connection, so boot is not
+    // a reconnect and the first beacon keeps its random spread
+    beacon_connected = (WiFi.status() == WL_CONNECTED);
+    beacon_delay = random(scratch_beacon_period + 1); // spread the first beacons
+    beacon_last_sent = millis();
+}
+
+void serviceBeacon(void) {
+    bool connected = (WiFi.status() == WL_CONNECTED);
+    if (connected && !beacon_connected) {
+        DEBUG_E4S("Beacon: WiFi connected\n");
+        requestBeacon();
+    }
+    beacon_connected = connected;
+    if (!scratch_multicast || !connected) {
+        return;
+    }
+    if (beaconChanged()) {
+        renderBeacon();
+        requestBeacon();
+    }
+    unsigned long elapsed = millis() - beacon_last_sent;
+    if (elapsed < BEACON_MIN_INTERVAL) {
+        return;
+    }
+    if (beacon_requested || elapsed >= beacon_delay) {
+        digitalWrite(LED, HIGH);
+        sendScratchMessageMulticast(beacon_message, beacon_message_size);
+        digitalWrite(LED, LOW);
+        beacon_last_sent = millis();
+        beacon_delay = nextBeaconDelay();
+        beacon_requested = false;
+    }
+}
+
+#endif
@@ -11,6 +11,8 @@
 #include <ArduinoJson.h>
 #include "FS.h"
 
+#include "WiFiConfServer.h"
+
 //#define DEBUG
 //#define DEBUG_E4S(...) Serial.printf( __VA_ARGS__ )
 //#define DEBUG_E4S(x) Serial.print(x)
@@ -23,9 +25,23 @@ struct ScratchClient {
     IPAddress ip;
     WiFiClient* wifi;
     unsigned long last_connected;
+    // frame being received, kept across loops
+    uint8_t size_data[4];
+    uint8_t size_read;          // bytes of the size header received so far
+    uint32_t message_size;      // valid when size_read is 4
+    uint32_t discard_size;      // bytes left of a message too large for the buffer
+    // backlog accounting
+    uint32_t frames;            // frames dispatched
+    uint16_t backlog;           // bytes left in the receive buffer after the last read
+    uint16_t backlog_max;
 };
 
 boolean scratch_multicast = false;
+#define SCRATCH_BEACON_PERIOD 10000U    // ms between two beacons
+#define SCRATCH_BEACON_JITTER 20        // percent of the period
+#define SCRATCH_BEACON_JITTER_MAX 50
+unsigned long scratch_beacon_period = SCRATCH_BEACON_PERIOD;
+uint8_t scratch_beacon_jitter = SCRATCH_BEACON_JITTER;
 #define SCRATCH_CONFIG_FILE_NAME "/scratch.json"
 
 bool loadScratchConfig() {
@@ -49,6 +65,12 @@ bool loadScratchConfig() {
       return false;
     }
     scratch_multicast = json["multicast"];
+    if (json.containsKey("beacon_period") && json["beacon_period"].as<unsigned long>() > 0) {
+        scratch_beacon_period = json["beacon_period"];
+    }
+    if (json.containsKey("beacon_jitter")) {
+        scratch_beacon_jitter = constrain(json["beacon_jitter"].as<int>(), 0, SCRATCH_BEACON_JITTER_MAX);
+    }
     DEBUG_E4S(String("Scratch multicast = ") + String((scratch_multicast ? "true" : "false")));
     return true;
 }
@@ -57,6 +79,8 @@ bool saveScratchConfig() {
   StaticJsonBuffer<200> jsonBuffer;
   JsonObject& json = jsonBuffer.createObject();
   json["multicast"] = scratch_multicast;
+  json["beacon_period"] = scratch_beacon_period;
+  json["beacon_jitter"] = scratch_beacon_jitter;
   File configFile = SPIFFS.open(SCRATCH_CONFIG_FILE_NAME, "w");
   if (!configFile) {
     Serial.println("Failed to open config file for writing");
@@ -77,10 +101,20 @@ WiFiUDP UdpAp;
 
 #define SCRATCH_CLIENTS_FILE_NAME "/scratch_clients.json"
 
+void resetScratchReader(ScratchClient* client) {
+    client->size_read = 0;
+    client->message_size = 0;
+    client->discard_size = 0;
+    client->frames = 0;
+    client->backlog = 0;
+    client->backlog_max = 0;
+}
+
 void initScratchClients() {
     for (int i = 0; i < SCRATCH_CLIENT_SIZE; i++) {
         scratch_clients[i].ip = IPAddress(0U);
         scratch_clients[i].wifi = new WiFiClient();
+        resetScratchReader(&scratch_clients[i]);
     }
 }
 
@@ -227,11 +261,42 @@ void removeScratch(IPAddress client_ip) {
                 scratch_clients[i].wifi->flush();
                 scratch_clients[i].wifi->stop();
             }
+            resetScratchReader(&scratch_clients[i]);
         }
     }
     saveScratchClients();
 }
 
+// wifi->connect() blocks, which would stall a sketch upload for every
+// registered host which is offline.
+bool mayConnectScratch(void) {
+    return (UpdateStatus.state != UPDATE_WRITING);
+}
+
+// Opens a new stream to the client, so the reader starts at a frame header.
+bool connectScratch(ScratchClient* client) {
+    if (!mayConnectScratch() || !client->wifi->connect(client->ip, scratch_port)) {
+        return false;
+    }
+    client->size_read = 0;
+    client->message_size = 0;
+    client->discard_size = 0;
+    return true;
+}
+
+// Reconnects the registered clients, which may block for every offline host.
+void connectScratchP2P(void) {
+    for (int i = 0; i < SCRATCH_CLIENT_SIZE; i++) {
+        WiFiClient* wifi = scratch_clients[i].wifi;
+        if ((scratch_clients[i].ip != IPAddress(0U)) && wifi && !wifi->connected()) {
+            if (connectScratch(&scratch_clients[i])) {
+                DEBUG_E4S(String("Scratch connected: ") + scratch_clients[i].ip[0] + "." + scratch_clients[i].ip[1] + "." + scratch_clients[i].ip[2] + "." + scratch_clients[i].ip[3]);
+            }
+        }
+    }
+}
+
+// Sends to the clients which connectScratchP2P() has connected.
 void sendScratchMessageP2P(char* message_data, uint32_t message_size) {
     uint8_t size_data[4];
     size_data[0] = (uint8_t)((message_size >> 24) & 0xFF);
@@ -240,15 +305,7 @@ void sendScratchMessageP2P(char* message_data, uint32_t message_size) {
     size_data[3] = (uint8_t)((message_size >>  0) & 0xFF);
     for (int i = 0; i < SCRATCH_CLIENT_SIZE; i++) {
         WiFiClient* wifi = scratch_clients[i].wifi;
-        if ((scratch_clients[i].ip != IPAddress(0U)) && wifi) {
-            if (!wifi->connected()) {
-                if (wifi->connect(scratch_clients[i].ip, scratch_port)) {
-                    DEBUG_E4S(String("Scratch connected: ") + scratch_clients[i].ip[0] + "." + scratch_clients[i].ip[1] + "." + scratch_clients[i].ip[2] + "." + scratch_clients[i].ip[3]);
-                } else {
-//                    DEBUG_E4S(String("fail to connect: ") + scratch_clients[i].ip[0] + "." + scratch_clients[i].ip[1] + "." + scratch_clients[i].ip[2] + "." + scratch_clients[i].ip[3]);
-                    continue;
-                }
-            }
+        if ((scratch_clients[i].ip != IPAddress(0U)) && wifi && wifi->connected()) {
             wifi->write((const uint8_t*)size_data, 4);
             wifi->write((const uint8_t*)message_data, message_size);
             scratch_clients[i].last_connected = millis();
@@ -266,36 +323,154 @@ void dispatchSensorUpdateReceivedP2P(char* message_data, uint32_t message_size)
     messageReceivedCallback(message_data, message_size);
 }
 
+// Each client may use up to SCRATCH_READ_FRAME_BUDGET frames and about
+// SCRATCH_READ_BYTE_BUDGET bytes per call, and the first client served rotates,
+// so that one busy host can neither starve the others nor be starved itself.
+#ifndef SCRATCH_READ_FRAME_BUDGET
+#define SCRATCH_READ_FRAME_BUDGET 8
+#endif
+#ifndef SCRATCH_READ_BYTE_BUDGET
+#define SCRATCH_READ_BYTE_BUDGET 1024
+#endif
+#define SCRATCH_MESSAGE_SIZE 256
+// Received messages are forwarded to the serial port at 9600 baud, about one
+// byte per ms. A frame is only dispatched when it fits into the free space of
+// the 128 byte UART TX FIFO, so println() does not block and the backlog stays
+// in lwIP where TCP slows the sender down. A frame larger than the FIFO waits
+// for it to be empty and then blocks for at most its excess, about 130 ms.
+#define SCRATCH_SINK_SIZE 128
+
+int scratch_read_start = 0;
+
+void readScratchFramesP2P(ScratchClient* client) {
+    WiFiClient* wifi = client->wifi;
+    char message_data[SCRATCH_MESSAGE_SIZE];
+    int frames = 0;
+    uint32_t bytes = 0;
+    while (frames < SCRATCH_READ_FRAME_BUDGET && bytes < SCRATCH_READ_BYTE_BUDGET) {
+        int available = wifi->available();
+        if (client->discard_size > 0) {
+            uint32_t discard_size = min((uint32_t)available, client->discard_size);
+            discard_size = min(discard_size, (uint32_t)SCRATCH_MESSAGE_SIZE);
+            int read_size = wifi->read((uint8_t*)message_data, discard_size);
+            if (read_size <= 0) {
+                break;
+            }
+            client->discard_size -= read_size;
+            bytes += read_size;
+            continue;
+        }
+        if (client->size_read < 4) {
+            if (available <= 0) {
+                break;
+            }
+            int read_size = wifi->read(client->size_data + client->size_read, 4 - client->size_read);
+            if (read_size <= 0) {
+                break;
+            }
+            client->size_read += read_size;
+            bytes += read_size;
+            if (client->size_read == 4) {
+                client->message_size = (uint32_t) client->size_data[0] << 24;
+                client->message_size |= (uint32_t) client->size_data[1] << 16;
+                client->message_size |= (uint32_t) client->size_data[2] << 8;
+                client->message_size |= (uint32_t) client->size_data[3];
+                if (client->message_size >= SCRATCH_MESSAGE_SIZE) {
+                    // too large for the buffer: discard it as it arrives
+                    DEBUG_E4S(String("Discarding a message of ") + client->message_size + " bytes");
+                    client->discard_size = client->message_size;
+                    client->size_read = 0;
+                    frames++;
+                }
+            }
+            continue;
+        }
+        if ((uint32_t)available < client->message_size) {
+            break; // wait for the rest of the frame
+        }
+        uint32_t sink_size = min(client->message_size + 2, (uint32_t)SCRATCH_SINK_SIZE);
+        if ((uint32_t)Serial.availableForWrite() < sink_size) {
+            break; // wait for the serial port to drain
+        }
+        uint32_t read_size = 0;
+        while (read_size < client->message_size) {
+            int chunk_size = wifi->read((uint8_t*)message_data + read_size, client->message_size - read_size);
+            if (chunk_size <= 0) {
+                break;
+            }
+            read_size += chunk_size;
+        }
+        bytes += read_size;
+        client->size_read = 0;
+        if (read_size < client->message_size) {
+            // never dispatch a partial frame: drop the rest as it arrives
+            DEBUG_E4S(String("Dropped a partial message of ") + client->message_size + " bytes");
+            client->discard_size = client->message_size - read_size;
+            frames++;
+            continue;
+        }
+        message_data[client->message_size] = '\0';
+//        DEBUG_E4S(String("Received[") + client->message_size + "]:" + message_data);
+        dispatchSensorUpdateReceivedP2P(message_data, client->message_size);
+        client->frames++;
+        frames++;
+    }
+    int backlog = wifi->available();
+    client->backlog = (backlog > 0xFFFF) ? 0xFFFF : backlog;
+    if (client->backlog > client->backlog_max) {
+        client->backlog_max = client->backlog;
+    }
+    if (bytes > 0) {
+        client->last_connected = millis();
+    }
+}
+
 void readScratchMessageP2P(void) {
-    for (int i = 0; i < SCRATCH_CLIENT_SIZE; i++) {
+    int first_served = -1;
+    for (int n = 0; n < SCRATCH_CLIENT_SIZE; n++) {
+        int i = (scratch_read_start + n) % SCRATCH_CLIENT_SIZE;
         WiFiClient* wifi = scratch_clients[i].wifi;
         if ((scratch_clients[i].ip != IPAddress(0U)) && wifi) {
+            if (first_served < 0) {
+                first_served = i;
+            }
             if (!wifi->connected()) {
-                if (wifi->connect(scratch_clients[i].ip, scratch_port)) {
+                if (connectScratch(&scratch_clients[i])) {
 //                    DEBUG_E4S(String("Scratch connected: ") + scratch_clients[i].ip[0] + "." + scratch_clients[i].ip[1] + "." + scratch_clients[i].ip[2] + "." + scratch_clients[i].ip[3]);
                 } else {
 //                    DEBUG_E4S(String("fail connected: ") + scratch_clients[i].ip[0] + "." + scratch_clients[i].ip[1] + "." + scratch_clients[i].ip[2] + "." + scratch_clients[i].ip[3]);
                     continue;
                 }
             }
-            if (wifi->available() <= 4) {
-                continue;
-            }
-            uint8_t size_data[4];
-            wifi->readBytes(size_data, 4);
-            uint32_t message_size;
-            message_size = (uint32_t) size_data[0] << 24;
-            message_size |=  (uint32_t) size_data[1] << 16;
-            message_size |= (uint32_t) size_data[2] << 8;
-            message_size |= (uint32_t) size_data[3];
-            char message_data[256];
-            wifi->readBytes(message_data, message_size);
-            message_data[message_size] = '\n';
-//            DEBUG_E4S(String("Received[") + message_size + "]:" + message_data);
-            dispatchSensorUpdateReceivedP2P(message_data, message_size);
-            scratch_clients[i].last_connected = millis();
+            readScratchFramesP2P(&scratch_clients[i]);
+        }
+    }
+    // the next call starts after the first registered client of this one,
+    // skipping the empty slots in between
+    if (first_served >= 0) {
+        scratch_read_start = (first_served + 1) % SCRATCH_CLIENT_SIZE;
+    }
+}
+
+String scratchBacklogJson(void) {
+    String json = "[";
+    for (int i = 0; i < SCRATCH_CLIENT_SIZE; i++) {
+        ScratchClient* client = &scratch_clients[i];
+        if (client->ip == IPAddress(0U)) {
+            continue;
+        }
+        if (json.length() > 1) {
+            json += ",";
         }
+        json += String("{\"ip\":\"") + client->ip[0] + "." + client->ip[1] + "." + client->ip[2] + "." + client->ip[3] + "\"";
+        json += String(",\"connected\":") + ((client->wifi && client->wifi->connected()) ? "true" : "false");
+        json += String(",\"frames\":") + client->frames;
+        json += String(",\"backlog\":") + client->backlog;
+        json += String(",\"backlog_max\":") + client->backlog_max;
+        json += "}";
     }
+    json += "]";
+    return json;
 }
 
 #endif
@@ -0,0 +1,186 @@
+/*
+ * File: SensorTrace.h
+ *
+ * Per-hop accounting for traced sensor-update messages.
+ * The Arduino adds "seq" and "ts-a" when tracing is on (sensor-update "trace" 1).
+ * The ESP counts gaps, reorders and delays on the serial hop and appends its own
+ * "ts-e" (line arrived) and "ts-s" (handed to the sockets) timestamps before
+ * forwarding, so the host can split the end-to-end latency per hop.
+ *
+ * A line may wait in the RX buffer while loop() is busy elsewhere, so its
+ * arrival is estimated from the bytes which already came in behind it.
+ */
+
+#ifndef __SENSOR_TRACE_H__
+#define __SENSOR_TRACE_H__
+
+#include <Arduino.h>
+
+#ifndef DEBUG_E4S
+#define DEBUG_E4S(x)
+#endif
+
+struct TraceStats {
+    // serial hop: Arduino -> ESP
+    uint32_t messages;
+    uint32_t gaps;              // sequence numbers still missing
+    uint32_t reorders;          // late sequence numbers which filled a gap
+    uint32_t duplicates;
+    uint32_t restarts;          // sequence restarted from 0
+    uint32_t jitter16;          // RFC 3550 interarrival jitter in ms, scaled by 16
+    uint32_t line_ms_max;       // first byte to end of line
+    uint16_t backlog_max;       // bytes waiting on the serial port at dispatch
+    // ESP hop: end of line arrived -> send call returned
+    uint32_t queue_ms_sum;
+    uint32_t queue_ms_max;
+    uint32_t send_ms_max;       // time spent in the send call
+    // last traced message
+    uint32_t last_seq;
+    uint32_t received;          // bit n: last_seq - 1 - n has been received
+    unsigned long last_sensor_ms;
+    unsigned long last_arrival_ms;
+} trace_stats;
+
+#define TRACE_RESTART_SEQ 8     // a restarted Arduino counts from 0
+#define TRACE_WINDOW 32         // sequence numbers tracked behind the latest one
+#ifdef BAUD
+#define TRACE_BYTE_US (10000000UL / BAUD)   // 8N1: 10 bits per byte
+#else
+#define TRACE_BYTE_US 1042UL                // 9600 baud
+#endif
+
+unsigned long trace_line_start = 0;  // ESP time the first byte of the current line was read
+unsigned long trace_line_read = 0;   // ESP time the end of the current line was read
+unsigned long trace_line_end = 0;    // estimated ESP time the end of the line arrived
+
+void resetTraceStats(void) {
+    memset(&trace_stats, 0, sizeof(trace_stats));
+}
+
+// Returns the number following "<name>" in the message, or -1 when it is missing.
+long traceField(String& message, const char* name) {
+    String key = String("\"") + name + "\" ";
+    int index = message.indexOf(key);
+    if (index < 0) {
+        return -1;
+    }
+    return message.substring(index + key.length()).toInt();
+}
+
+void traceLineStarted(void) {
+    trace_line_start = millis();
+}
+
+// backlog is the number of bytes which arrived after the end of the line and
+// are still in the RX buffer. The end of the line arrived at least that many
+// byte times ago; the estimate is low only when the Arduino paused meanwhile.
+void traceLineEnded(int backlog) {
+    trace_line_read = millis();
+    trace_line_end = trace_line_read - (unsigned long)backlog * TRACE_BYTE_US / 1000;
+}
+
+// True when seq is behind the latest one and has not been received yet.
+bool traceMissing(TraceStats& stats, uint32_t seq) {
+    uint32_t behind = stats.last_seq - 1 - seq;
+    return (seq < stats.last_seq) && (behind < TRACE_WINDOW) && !(stats.received & (1UL << behind));
+}
+
+// Accounts a sensor-update which is about to be written to the sockets and
+// appends the ESP timestamps to it. Call it after the clients are connected,
+// so that "ts-s" does not include the connect. Returns false for untraced
+// messages, which are left as is.
+bool traceMessage(String& message, int backlog) {
+    long seq = traceField(message, "seq");
+    long sensor_ms = traceField(message, "ts-a");
+    if (seq < 0 || sensor_ms < 0) {
+        return false;
+    }
+    TraceStats& stats = trace_stats;
+    bool first = (stats.messages == 0);
+    int32_t diff = (int32_t)((uint32_t)seq - stats.last_seq);
+    // A reordered message can only fill a gap, so a sequence which starts over
+    // from near 0, well behind the latest one, at a number which is not missing
+    // is a restart. Both messages carry an older "ts-a", so the clock does not help.
+    if (!first && seq <= TRACE_RESTART_SEQ && stats.last_seq > (uint32_t)seq + TRACE_RESTART_SEQ
+            && !traceMissing(stats, seq)) {
+        DEBUG_E4S(String("trace: Arduino restarted at seq ") + seq);
+        stats.restarts++;
+        first = true;
+    }
+    if (!first) {
+        if (diff > 0) {
+            stats.gaps += diff - 1;
+            stats.received = (diff < TRACE_WINDOW) ? (stats.received << diff) : 0;
+            if (diff <= TRACE_WINDOW) {
+                stats.received |= 1UL << (diff - 1);
+            }
+            int32_t transit = (int32_t)(trace_line_end - stats.last_arrival_ms) - (int32_t)(sensor_ms - stats.last_sensor_ms);
+            stats.jitter16 += (uint32_t)abs(transit) - ((stats.jitter16 + 8) >> 4);
+        } else if (traceMissing(stats, seq)) {
+            stats.reorders++;
+            stats.received |= 1UL << (stats.last_seq - 1 - seq);
+            stats.gaps--;
+        } else if (diff < -TRACE_WINDOW) {
+            stats.reorders++;   // too late to tell which gap it fills
+        } else {
+            stats.duplicates++;
+        }
+    }
+    if (first) {
+        stats.received = 0xFFFFFFFFUL;  // nothing before the first one is missing
+    }
+    if (first || diff > 0) {
+        stats.last_seq = seq;
+        stats.last_sensor_ms = sensor_ms;
+        stats.last_arrival_ms = trace_line_end;
+    }
+    stats.messages++;
+    uint32_t line_ms = trace_line_read - trace_line_start;
+    if (line_ms > stats.line_ms_max) {
+        stats.line_ms_max = line_ms;
+    }
+    if (backlog > stats.backlog_max) {
+        stats.backlog_max = backlog;
+    }
+    if (!message.endsWith(" ")) {
+        message += " ";
+    }
+    message += String("\"ts-e\" ") + trace_line_end + " \"ts-s\" " + millis() + " ";
+    return true;
+}
+
+// Accounts the ESP hop of a traced message once the send call has returned.
+void traceSent(unsigned long send_started) {
+    TraceStats& stats = trace_stats;
+    unsigned long sent_ms = millis();
+    uint32_t queue_ms = sent_ms - trace_line_end;
+    stats.queue_ms_sum += queue_ms;
+    if (queue_ms > stats.queue_ms_max) {
+        stats.queue_ms_max = queue_ms;
+    }
+    uint32_t send_ms = sent_ms - send_started;
+    if (send_ms > stats.send_ms_max) {
+        stats.send_ms_max = send_ms;
+    }
+}
+
+String traceStatsJson(void) {
+    TraceStats& stats = trace_stats;
+    String json = "{\"serial\":{";
+    json += String("\"messages\":") + stats.messages;
+    json += String(",\"gaps\":") + stats.gaps;
+    json += String(",\"reorders\":") + stats.reorders;
+    json += String(",\"duplicates\":") + stats.duplicates;
+    json += String(",\"restarts\":") + stats.restarts;
+    json += String(",\"jitter_ms\":") + (stats.jitter16 >> 4);
+    json += String(",\"line_ms_max\":") + stats.line_ms_max;
+    json += String(",\"backlog_max\":") + stats.backlog_max;
+    json += "},\"esp\":{";
+    json += String("\"queue_ms_avg\":") + (stats.messages ? stats.queue_ms_sum / stats.messages : 0);
+    json += String(",\"queue_ms_max\":") + stats.queue_ms_max;
+    json += String(",\"send_ms_max\":") + stats.send_ms_max;
+    json += "}}";
+    return json;
+}
+
+#endif
@@ -10,6 +10,8 @@
 #include <ESP8266mDNS.h>
 #include <ESP8266WebServer.h>
 #include <EEPROM.h>
+#include <StreamString.h>
+#include <flash_utils.h>
 
 //#define DEBUG_WIFICONF(...) Serial.printf( __VA_ARGS__ )
 
@@ -234,7 +236,90 @@ void setupWiFiConfWeb(void) {
     });
 }
 
-const char* sketchUploadForm = "<form method='POST' action='/upload_sketch' enctype='multipart/form-data'><input type='file' name='sketch'><input type='submit' value='Upload' onclick='return confirm(\"Are you sure you want to update the Sketch?\");'></form>";
+const char* sketchUploadForm = "<form method='POST' action='/upload_sketch' enctype='multipart/form-data'"
+    " onsubmit='this.action=\"/upload_sketch?md5=\" + this.md5.value + \"&size=\" + this.sketch.files[0].size; return confirm(\"Are you sure you want to update the Sketch?\");'>"
+    "<input type='file' name='sketch' required> "
+    "<label for='md5'>MD5: </label><input name='md5' id='md5' maxlength=32 size=34 required> "
+    "<input type='submit' value='Upload'></form>"
+    "<p>Progress: <a href='/update_status'>/update_status</a></p>";
+
+#define UPDATE_REPORT_INTERVAL 1000U    // ms between progress lines on the serial port
+
+enum UpdateState {
+    UPDATE_IDLE,
+    UPDATE_WRITING,
+    UPDATE_SUCCESS,
+    UPDATE_FAILED
+};
+const char* update_state_names[] = {"idle", "writing", "success", "failed"};
+
+struct UpdateStatusStruct {
+    UpdateState state;
+    String error;
+    uint32_t size;              // expected size, 0 when unknown
+    uint32_t written;
+    unsigned long started;
+    unsigned long finished;
+    unsigned long last_report;
+} UpdateStatus = {
+    UPDATE_IDLE,
+    "",
+    0, 0, 0, 0, 0
+};
+
+// Called after each flash sector is written so that the application keeps
+// forwarding messages while a sketch is uploaded.
+void (*updateServiceCallback)(void) = NULL;
+
+void attachUpdateService(void (*handler)(void)) {
+    updateServiceCallback = handler;
+}
+
+uint32_t updateThroughput(void) {
+    unsigned long end = (UpdateStatus.finished ? UpdateStatus.finished : millis());
+    unsigned long elapsed = end - UpdateStatus.started;
+    if (elapsed == 0) {
+        return 0;
+    }
+    return (uint64_t)UpdateStatus.written * 1000 / elapsed;
+}
+
+String updateStatusJson(void) {
+    String json = "{\"state\":\"";
+    json += update_state_names[UpdateStatus.state];
+    json += String("\",\"written\":") + UpdateStatus.written;
+    json += String(",\"size\":") + UpdateStatus.size;
+    if (UpdateStatus.size > 0) {
+        json += String(",\"percent\":") + (uint32_t)((uint64_t)UpdateStatus.written * 100 / UpdateStatus.size);
+    }
+    json += String(",\"bytes_per_sec\":") + updateThroughput();
+    json += ",\"error\":\"";
+    json += UpdateStatus.error;
+    json += "\"}";
+    return json;
+}
+
+void reportUpdateProgress(bool force) {
+    if (force || millis() - UpdateStatus.last_report >= UPDATE_REPORT_INTERVAL) {
+        UpdateStatus.last_report = millis();
+        Serial.printf("update=%s\n", updateStatusJson().c_str());
+    }
+}
+
+void failUpdate(String error) {
+    DEBUG_WIFICONF("Update failed: %s\n", error.c_str());
+    UpdateStatus.state = UPDATE_FAILED;
+    UpdateStatus.error = error;
+    UpdateStatus.finished = millis();
+    reportUpdateProgress(true);
+}
+
+String updateError(void) {
+    StreamString error;
+    Update.printError(error);
+    error.trim();
+    return error;
+}
 
 void setupWebUpdate(void) {
     server.on("/update", HTTP_GET, [] () {
@@ -242,36 +327,91 @@ void setupWebUpdate(void) {
         server.sendHeader("Access-Control-Allow-Origin", "*");
         server.send(200, "text/html", sketchUploadForm);
     });
+    server.on("/update_status", HTTP_GET, [] () {
+        server.sendHeader("Access-Control-Allow-Origin", "*");
+        server.send(200, "application/json", updateStatusJson());
+    });
+    // Update.write() copies each upload buffer into the Updater's sector buffer,
+    // which is erased and written to flash once FLASH_SECTOR_SIZE bytes are
+    // collected. The service runs after each of these sector writes. The MD5
+    // digest given in the query is verified by Update.end() before the new
+    // sketch is committed.
     server.onFileUpload([] () {
         if (server.uri() != "/upload_sketch") return;
         HTTPUpload& upload = server.upload();
         if (upload.status == UPLOAD_FILE_START) {
-            //      Serial.setDebugOutput(true);
-            WiFiUDP::stopAll();
             DEBUG_WIFICONF("Sketch: %s\n", upload.filename.c_str());
+            UpdateStatus.state = UPDATE_WRITING;
+            UpdateStatus.error = "";
+            UpdateStatus.size = server.arg("size").toInt();
+            UpdateStatus.written = 0;
+            UpdateStatus.started = millis();
+            UpdateStatus.finished = 0;
+            UpdateStatus.last_report = 0;
+            String md5 = server.arg("md5");
+            md5.trim();
+            md5.toLowerCase();
+            if (md5.length() != 32) {
+                failUpdate("MD5 digest is required");
+                return;
+            }
             uint32_t maxSketchSpace = (ESP.getFreeSketchSpace() - 0x1000) & 0xFFFFF000;
+            if (UpdateStatus.size > maxSketchSpace) {
+                failUpdate("Sketch is too large");
+                return;
+            }
             if (!Update.begin(maxSketchSpace)) { //start with max available size
-                Update.printError(Serial);
+                failUpdate(updateError());
+                return;
             }
+            Update.setMD5(md5.c_str());
+            reportUpdateProgress(true);
         } else if (upload.status == UPLOAD_FILE_WRITE) {
+            if (UpdateStatus.state != UPDATE_WRITING) {
+                return; // drain the rest of a rejected upload
+            }
             if (Update.write(upload.buf, upload.currentSize) != upload.currentSize) {
-                Update.printError(Serial);
+                String error = updateError();
+                Update.end(false);
+                failUpdate(error);
+                return;
+            }
+            uint32_t sectors = UpdateStatus.written / FLASH_SECTOR_SIZE;
+            UpdateStatus.written += upload.currentSize;
+            if (UpdateStatus.written / FLASH_SECTOR_SIZE != sectors && updateServiceCallback) {
+                updateServiceCallback();
             }
+            reportUpdateProgress(false);
         } else if (upload.status == UPLOAD_FILE_END) {
+            if (UpdateStatus.state != UPDATE_WRITING) {
+                return;
+            }
             if (Update.end(true)) { //true to set the size to the current progress
-                DEBUG_WIFICONF("Update Success: %u\nRebooting...\n", upload.totalSize);
+                DEBUG_WIFICONF("Update Success: %u\n", upload.totalSize);
+                UpdateStatus.state = UPDATE_SUCCESS;
+                UpdateStatus.finished = millis();
+                reportUpdateProgress(true);
             } else {
-                Update.printError(Serial);
+                failUpdate(updateError());
+            }
+        } else if (upload.status == UPLOAD_FILE_ABORTED) {
+            if (UpdateStatus.state == UPDATE_WRITING) {
+                Update.end(false);
+                failUpdate("Upload aborted");
             }
-            //      Serial.setDebugOutput(false);
         }
         yield();
     });
     server.on("/upload_sketch", HTTP_POST, [] () {
+        bool success = (UpdateStatus.state == UPDATE_SUCCESS);
         server.sendHeader("Connection", "close");
         server.sendHeader("Access-Control-Allow-Origin", "*");
-        server.send(200, "text/plain", (Update.hasError()) ? "FAIL" : "OK");
-        ESP.restart();
+        server.send(success ? 200 : 500, "application/json", updateStatusJson());
+        if (success) {
+            DEBUG_WIFICONF("Rebooting...\n");
+            delay(100);
+            ESP.restart();
+        }
     });
 }
 
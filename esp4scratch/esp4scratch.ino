@@ -34,6 +34,8 @@ void setup() {
 //
 
 #include "ScratchClient.h"
+#include "SensorTrace.h"
+#include "ScratchBeacon.h"
 
 
 void setupWeb(void) {
@@ -73,6 +75,7 @@ void setupWeb(void) {
     });
 
     setupScratch();
+    setupBeacon();
     setupScratchWeb();
 }
 
@@ -90,6 +93,12 @@ void setupScratchWeb(void) {
             content += " checked='checked'";
         }
         content += "><label for='multicast'>Multicast Module-IP</label> ";
+        content += "<label for='beacon_period'>every </label><input name='beacon_period' id='beacon_period' maxlength=5 size=5 value='";
+        content += String(scratch_beacon_period / 1000);
+        content += "'> sec ";
+        content += "<label for='beacon_jitter'>&plusmn; </label><input name='beacon_jitter' id='beacon_jitter' maxlength=2 size=2 value='";
+        content += String(scratch_beacon_jitter);
+        content += "'> % ";
         content += "<input type='submit'></form>";
         content += "<p><a href='/'>Return to Top</a></p>";
         content += "</html>";
@@ -104,7 +113,14 @@ void setupScratchWeb(void) {
             DEBUG_E4S("Set scratch_multicast to false\n");
             scratch_multicast = false;
         }
+        if (server.arg("beacon_period").toInt() > 0) {
+            scratch_beacon_period = server.arg("beacon_period").toInt() * 1000;
+        }
+        if (server.hasArg("beacon_jitter")) {
+            scratch_beacon_jitter = constrain(server.arg("beacon_jitter").toInt(), 0, SCRATCH_BEACON_JITTER_MAX);
+        }
         saveScratchConfig();
+        requestBeacon();
         String content;
         content = "<!DOCTYPE HTML>\r\n<html>";
         content += "<p>Saved to EEPROM </p>";
@@ -115,10 +131,28 @@ void setupScratchWeb(void) {
             content += "false";
         }
         content += "</p>";
+        content += "<p>Period: ";
+        content += String(scratch_beacon_period / 1000);
+        content += " sec &plusmn; ";
+        content += String(scratch_beacon_jitter);
+        content += " %</p>";
         content += "</body></html>";
         server.send(200, "text/html", content);
     });
 
+    server.on("/trace", []() {
+        if (server.arg("reset").equals(String("1"))) {
+            resetTraceStats();
+        }
+        server.sendHeader("Access-Control-Allow-Origin", "*");
+        server.send(200, "application/json", traceStatsJson());
+    });
+
+    server.on("/scratch_backlog", []() {
+        server.sendHeader("Access-Control-Allow-Origin", "*");
+        server.send(200, "application/json", scratchBacklogJson());
+    });
+
     server.on("/change_scratch_ip", []() {
         IPAddress scratch_ip = IPAddress(server.arg("scratch_ip_0").toInt(), server.arg("scratch_ip_1").toInt(), server.arg("scratch_ip_2").toInt(), server.arg("scratch_ip_3").toInt());
         String content = "<!DOCTYPE HTML>\r\n<html><head><title>";
@@ -253,39 +287,35 @@ void setupCommandPort(void) {
     COMMAND_PORT.println();
     COMMAND_PORT.println("ready:esp4scratch");
     attachMessageReceivedP2P(receivedCallback);
-}
-
-boolean cycleCheck(unsigned long *lastMillis, unsigned int cycle)
-{
-    unsigned long currentMillis = millis();
-    if (currentMillis - *lastMillis >= cycle)
-    {
-        *lastMillis = currentMillis;
-        return true;
-    } else {
-        return false;
-    }
+    attachUpdateService(serviceScratch);
 }
 
 void readCommand(void) {
     while (COMMAND_PORT.available()) {
         char in_char = (char)COMMAND_PORT.read();
         if (in_char == '\n') {
+            traceLineEnded(COMMAND_PORT.available());
             command_end = true;
             break;
         } else {
+            if (command_buffer.length() == 0) {
+                traceLineStarted();
+            }
             command_buffer += in_char;
         }
     }
 }
 
-#define scratch_update_cycle 10000U
-unsigned long scratch_last_update = 0;
-
 void loop() {
     // handle requests for web
     server.handleClient();
 
+    serviceScratch();
+}
+
+// Everything except the web server, so that it can also run between the
+// flash writes of a sketch upload.
+void serviceScratch(void) {
     readScratchMessageP2P();
 
     readCommand();
@@ -299,14 +329,29 @@ void loop() {
             sendScratchMessageMulticast(message_data, message_size);
             digitalWrite(LED, LOW);
         } else if (command_buffer.startsWith("send:", 0)) {
-            uint32_t message_size = command_buffer.length() - 5;
-            char message_data[message_size];
-            command_buffer.substring(5).toCharArray(message_data, message_size + 1);
+            String message = command_buffer.substring(5);
+            unsigned long send_started = millis();
             digitalWrite(LED, HIGH);
+            connectScratchP2P();
+            bool traced = traceMessage(message, COMMAND_PORT.available());
+            uint32_t message_size = message.length();
+            char message_data[message_size + 1];
+            message.toCharArray(message_data, message_size + 1);
             sendScratchMessageP2P(message_data, message_size);
             digitalWrite(LED, LOW);
+            if (traced) {
+                traceSent(send_started);
+            }
         } else if (command_buffer.startsWith("module_id?", 0)) {
             COMMAND_PORT.printf("module_id=%s\n", WiFiConf.module_id);
+        } else if (command_buffer.startsWith("trace?", 0)) {
+            COMMAND_PORT.printf("trace=%s\n", traceStatsJson().c_str());
+        } else if (command_buffer.startsWith("trace_reset", 0)) {
+            resetTraceStats();
+        } else if (command_buffer.startsWith("backlog?", 0)) {
+            COMMAND_PORT.printf("backlog=%s\n", scratchBacklogJson().c_str());
+        } else if (command_buffer.startsWith("update?", 0)) {
+            COMMAND_PORT.printf("update=%s\n", updateStatusJson().c_str());
         } else {
             COMMAND_PORT.printf("ERROR=%s\n", command_buffer.c_str());
         }
@@ -314,19 +359,5 @@ void loop() {
         command_end = false;
     }
 
-    if (cycleCheck(&scratch_last_update, scratch_update_cycle)) {
-        if (scratch_multicast) {
-            IPAddress ip = WiFi.localIP();
-            String ipStr = String(ip[0]) + '.' + String(ip[1]) + '.' + String(ip[2]) + '.' + String(ip[3]);
-            char message[32] = {0};
-            strcpy(message, "sensor-update \"");
-            strcat(message, WiFiConf.module_id);
-            strcat(message, "\" \"");
-            strcat(message, ipStr.c_str());
-            strcat(message, "\" ");
-            digitalWrite(LED, HIGH);
-            sendScratchMessageMulticast(message, strlen(message));
-            digitalWrite(LED, LOW);
-        }
-    }
+    serviceBeacon();
 }
@@ -0,0 +1,230 @@
+/*
+ * File: SensorSampler.h
+ *
+ * Sampling engine for the analog pins A0-A5 and the digital pin D2.
+ * The ADC runs in free-running mode and every conversion is collected by
+ * the ADC interrupt, so sampling never blocks handleCommand().
+ * D2 is watched by a pin change interrupt and reported as soon as it changes.
+ */
+
+#ifndef __SENSOR_SAMPLER_H__
+#define __SENSOR_SAMPLER_H__
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "Arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+#define SAMPLER_ANALOG_SIZE 6
+#define SAMPLER_DIGITAL_PIN 2
+#define SAMPLER_DEFAULT_RATE 5          // reports per second (former 200 ms cycle)
+#define SAMPLER_MAX_RATE 50             // reports per second and channel, see reportSamples()
+#define SAMPLER_DEFAULT_OVERSAMPLE 4    // conversions averaged into one value
+#define SAMPLER_MAX_OVERSAMPLE 64
+#define SAMPLER_MIN_REPORT_INTERVAL 20U // ms between two messages to the ESP
+#define SAMPLER_MESSAGE_SIZE 160
+
+struct AnalogChannel {
+  uint8_t rate;               // reports per second, 0 to disable the channel
+  unsigned long last_report;
+  volatile uint16_t value;    // latest averaged value
+  volatile uint32_t sum;      // conversions accumulated for the next value
+  volatile uint8_t count;
+};
+
+AnalogChannel analog_channels[SAMPLER_ANALOG_SIZE];
+volatile uint8_t sampler_oversample = SAMPLER_DEFAULT_OVERSAMPLE;
+
+// In free-running mode the next conversion has already started when the
+// interrupt fires, so a new channel selection applies one conversion later.
+volatile uint8_t sampler_converting = 0; // channel of the conversion in progress
+volatile uint8_t sampler_queued = 0;     // channel latched for the next conversion
+
+uint8_t digital_rate = SAMPLER_DEFAULT_RATE;
+unsigned long digital_last_report = 0;
+volatile uint8_t digital_state = HIGH;
+volatile bool digital_changed = false;
+
+unsigned long sampler_last_report = 0;
+
+// Report being written to COMMAND_PORT without blocking.
+char sampler_message[SAMPLER_MESSAGE_SIZE] = {0};
+int sampler_message_length = 0;
+int sampler_message_sent = 0;
+
+// Optional "seq" and "ts-a" fields for the trace accounting on the ESP.
+bool sampler_trace = false;
+unsigned long sampler_seq = 0;
+
+uint8_t adcChannel(uint8_t index) {
+#ifdef analogPinToChannel
+  return analogPinToChannel(index); // Leonardo: A0-A5 are not ADC0-ADC5
+#else
+  return index;
+#endif
+}
+
+void selectAdcChannel(uint8_t index) {
+  uint8_t channel = adcChannel(index);
+#ifdef MUX5
+  ADCSRB = (ADCSRB & ~(1 << MUX5)) | (((channel >> 3) & 0x01) << MUX5);
+#endif
+  ADMUX = (1 << REFS0) | (channel & 0x07); // AVcc reference
+}
+
+uint8_t nextAnalogChannel(uint8_t index) {
+  for (uint8_t i = 1; i <= SAMPLER_ANALOG_SIZE; i++) {
+    uint8_t next = (index + i) % SAMPLER_ANALOG_SIZE;
+    if (analog_channels[next].rate != 0) {
+      return next;
+    }
+  }
+  return index; // all disabled: keep converting the same channel
+}
+
+ISR(ADC_vect) {
+  uint16_t result = ADC;
+  AnalogChannel* channel = &analog_channels[sampler_converting];
+  channel->sum += result;
+  channel->count++;
+  if (channel->count >= sampler_oversample) {
+    channel->value = channel->sum / channel->count;
+    channel->sum = 0;
+    channel->count = 0;
+  }
+  sampler_converting = sampler_queued;
+  sampler_queued = nextAnalogChannel(sampler_queued);
+  selectAdcChannel(sampler_queued);
+}
+
+void digitalChanged(void) {
+  digital_state = digitalRead(SAMPLER_DIGITAL_PIN);
+  digital_changed = true;
+}
+
+void setupSampler(void) {
+  for (int i = 0; i < SAMPLER_ANALOG_SIZE; i++) {
+    analog_channels[i].rate = SAMPLER_DEFAULT_RATE;
+    analog_channels[i].last_report = 0;
+    analog_channels[i].value = 0;
+    analog_channels[i].sum = 0;
+    analog_channels[i].count = 0;
+  }
+  pinMode(SAMPLER_DIGITAL_PIN, INPUT_PULLUP);
+  digital_state = digitalRead(SAMPLER_DIGITAL_PIN);
+  attachInterrupt(digitalPinToInterrupt(SAMPLER_DIGITAL_PIN), digitalChanged, CHANGE);
+
+  sampler_converting = 0;
+  sampler_queued = 0;
+  selectAdcChannel(0);
+#ifdef ADTS0
+  ADCSRB &= ~((1 << ADTS2) | (1 << ADTS1) | (1 << ADTS0)); // free-running trigger
+#endif
+  // 16MHz / 128 = 125kHz ADC clock, about 9.6k conversions per second
+  ADCSRA = (1 << ADEN) | (1 << ADATE) | (1 << ADIE) | (1 << ADPS2) | (1 << ADPS1) | (1 << ADPS0);
+  ADCSRA |= (1 << ADSC);
+}
+
+uint8_t samplerRate(float value) {
+  return (max(0, min(SAMPLER_MAX_RATE, value)));
+}
+
+// Accepts "rate" (all channels), "rate-a0".."rate-a5", "rate-d2", "oversample"
+// and "trace".
+void updateSampler(String& name, float value) {
+  if (name.equalsIgnoreCase(String("\"trace\""))) {
+    sampler_trace = (value != 0);
+    DEBUG_PRINT(String("DEBUG:trace=") + sampler_trace);
+  } else if (name.equalsIgnoreCase(String("\"oversample\""))) {
+    sampler_oversample = max(1, min(SAMPLER_MAX_OVERSAMPLE, value));
+    DEBUG_PRINT(String("DEBUG:oversample=") + sampler_oversample);
+  } else if (name.equalsIgnoreCase(String("\"rate\""))) {
+    for (int i = 0; i < SAMPLER_ANALOG_SIZE; i++) {
+      analog_channels[i].rate = samplerRate(value);
+    }
+    digital_rate = samplerRate(value);
+    DEBUG_PRINT(String("DEBUG:rate=") + samplerRate(value));
+  } else if (name.equalsIgnoreCase(String("\"rate-d") + SAMPLER_DIGITAL_PIN + "\"")) {
+    digital_rate = samplerRate(value);
+    DEBUG_PRINT(String("DEBUG:rate-d2=") + digital_rate);
+  } else {
+    for (int i = 0; i < SAMPLER_ANALOG_SIZE; i++) {
+      if (name.equalsIgnoreCase(String("\"rate-a") + i + "\"")) {
+        analog_channels[i].rate = samplerRate(value);
+        DEBUG_PRINT(String("DEBUG:rate-a") + i + "=" + analog_channels[i].rate);
+      }
+    }
+  }
+}
+
+bool reportDue(uint8_t rate, unsigned long *lastMillis, unsigned long currentMillis) {
+  if (rate == 0 || currentMillis - *lastMillis < 1000U / rate) {
+    return false;
+  }
+  *lastMillis = currentMillis;
+  return true;
+}
+
+// Writes as much of the pending report as the TX buffer accepts.
+// Returns true when nothing is left to send.
+bool flushReport(void) {
+  int remaining = sampler_message_length - sampler_message_sent;
+  if (remaining > 0) {
+    int room = COMMAND_PORT.availableForWrite();
+    if (room > 0) {
+      int size = min(room, remaining);
+      COMMAND_PORT.write((const uint8_t*)sampler_message + sampler_message_sent, size);
+      sampler_message_sent += size;
+    }
+  }
+  return (sampler_message_sent >= sampler_message_length);
+}
+
+// Sends every channel whose period has elapsed in one sensor-update message.
+// A full report is about 86 bytes (121 with trace fields) and 9600 baud carries
+// about 960 bytes per second, so the link limits the reports to roughly 8-11
+// per second, whatever the channel rates are. The report is queued and written
+// only as fast as the TX buffer drains, so loop() never blocks on the serial port.
+// Channels which become due meanwhile wait and go into the next report.
+void reportSamples(void) {
+  if (!flushReport()) {
+    return;
+  }
+  unsigned long currentMillis = millis();
+  if (currentMillis - sampler_last_report < SAMPLER_MIN_REPORT_INTERVAL) {
+    return;
+  }
+  char* message = sampler_message;
+  int length = sprintf(message, "send:sensor-update ");
+  const int header_length = length;
+  for (int i = 0; i < SAMPLER_ANALOG_SIZE; i++) {
+    if (reportDue(analog_channels[i].rate, &analog_channels[i].last_report, currentMillis)) {
+      noInterrupts();
+      uint16_t value = analog_channels[i].value;
+      interrupts();
+      length += sprintf(message + length, "\"A%d\" %u ", i, value);
+    }
+  }
+  noInterrupts();
+  bool changed = digital_changed;
+  uint8_t state = digital_state;
+  digital_changed = false;
+  interrupts();
+  if (reportDue(digital_rate, &digital_last_report, currentMillis) || changed) {
+    digital_last_report = currentMillis;
+    length += sprintf(message + length, "\"D%d\" %d ", SAMPLER_DIGITAL_PIN, state);
+  }
+  if (length > header_length) {
+    if (sampler_trace) {
+      length += sprintf(message + length, "\"seq\" %lu \"ts-a\" %lu ", sampler_seq++, currentMillis);
+    }
+    length += sprintf(message + length, "\r\n");
+    sampler_message_length = length;
+    sampler_message_sent = 0;
+    sampler_last_report = currentMillis;
+    flushReport();
+  }
+}
+
+#endif
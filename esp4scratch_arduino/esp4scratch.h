@@ -38,6 +38,12 @@ bool command_end = false;  // whether the string is complete
 
 int ledPin = 13;
 
+void (*sensorUpdateReceivedCallback)(String& name, float value) = NULL;
+
+void attachSensorUpdateReceived(void (*handler)(String& name, float value)) {
+  sensorUpdateReceivedCallback = handler;
+}
+
 void setupConnection(void) {
 #ifdef DEBUG
   DEBUG_PORT.begin(BAUD);
@@ -126,6 +132,9 @@ void handleCommand(void) {
           analogWrite(3, pmwValue(dataValue));
           DEBUG_PRINT(String("DEBUG:pwm3=") + pmwValue(dataValue));
         }
+        if (sensorUpdateReceivedCallback) {
+          sensorUpdateReceivedCallback(dataName, dataValue);
+        }
       }
       readIndex = valueEnd + 1;
     }
@@ -0,0 +1,216 @@
+#!/usr/bin/env python3
+"""
+File: rsp_trace.py
+
+Capture and analyze traced sensor-update messages of the Scratch WiFi Board.
+
+Enable tracing on the Arduino with the sensor-update "trace" 1. Each message
+then carries "seq" and "ts-a" (Arduino millis) and the ESP appends "ts-e"
+(line arrived, estimated from the bytes queued behind it) and "ts-s" (written
+to the sockets, after any reconnect), both in ESP millis.
+
+  capture: stands in for Scratch on port 42001 and records every message
+           with the host arrival time.
+      python3 rsp_trace.py capture trace.log
+  analyze: reports loss, reorders and per-hop latency and jitter histograms.
+      python3 rsp_trace.py analyze trace.log
+
+The three clocks are not synchronized, so the serial, WiFi and end-to-end
+latencies are shown relative to their minimum in the capture. The ESP queueing
+delay, RX buffer wait and reconnects included, is measured on one clock and is
+absolute.
+"""
+
+import argparse
+import re
+import socket
+import struct
+import sys
+import time
+
+SCRATCH_PORT = 42001
+RESTART_SEQ = 8  # a restarted Arduino counts from 0
+FIELD = re.compile(r'"(seq|ts-a|ts-e|ts-s)" (-?\d+)')
+
+
+def capture(path, port):
+    server = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    server.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    server.bind(("", port))
+    server.listen(1)
+    print("waiting for the board on port %d" % port, file=sys.stderr)
+    with open(path, "a") as out:
+        while True:
+            conn, addr = server.accept()
+            print("connected: %s" % addr[0], file=sys.stderr)
+            try:
+                while True:
+                    header = read_exactly(conn, 4)
+                    if header is None:
+                        break
+                    (size,) = struct.unpack(">I", header)
+                    body = read_exactly(conn, size)
+                    if body is None:
+                        break
+                    host_ms = int(time.time() * 1000)
+                    out.write("%d\t%s\n" % (host_ms, body.decode("utf-8", "replace")))
+                    out.flush()
+            finally:
+                conn.close()
+                print("disconnected: %s" % addr[0], file=sys.stderr)
+
+
+def read_exactly(conn, size):
+    data = b""
+    while len(data) < size:
+        chunk = conn.recv(size - len(data))
+        if not chunk:
+            return None
+        data += chunk
+    return data
+
+
+def load(path):
+    records = []
+    with open(path) as log:
+        for line in log:
+            host, _, message = line.rstrip("\n").partition("\t")
+            fields = dict((name, int(value)) for name, value in FIELD.findall(message))
+            if len(fields) == 4:
+                fields["host"] = int(host)
+                records.append(fields)
+    return records
+
+
+def restarted(seq, first, latest, received):
+    """A reordered message can only fill a gap, so a sequence which starts over
+    from near 0, well behind the latest one, at a number which is not missing
+    is a restart. Both carry an older ts-a, so the clock does not help."""
+    missing = first <= seq < latest and seq not in received
+    return seq <= RESTART_SEQ and latest > seq + RESTART_SEQ and not missing
+
+
+def split_restarts(records):
+    """Splits the capture where the Arduino restarted."""
+    runs = [[]]
+    received = set()
+    first = latest = None
+    for record in records:
+        seq = record["seq"]
+        if received and restarted(seq, first, latest, received):
+            runs.append([])
+            received = set()
+        if not received:
+            first = latest = seq
+        runs[-1].append(record)
+        received.add(seq)
+        first = min(first, seq)
+        latest = max(latest, seq)
+    return [run for run in runs if run]
+
+
+def sequence_stats(run):
+    """Returns the lost, reordered and duplicated messages of one run. A lost
+    message is one which never arrived, so a late one fills its gap."""
+    received = set()
+    reorders = 0
+    latest = None
+    for record in run:
+        seq = record["seq"]
+        if seq not in received and latest is not None and seq < latest:
+            reorders += 1
+        received.add(seq)
+        latest = seq if latest is None else max(latest, seq)
+    expected = max(received) - min(received) + 1
+    return expected - len(received), reorders, len(run) - len(received)
+
+
+def hops(run):
+    """Returns the per-hop latency series in ms for one run."""
+    series = {
+        "serial": [r["ts-e"] - r["ts-a"] for r in run],
+        "esp queue": [r["ts-s"] - r["ts-e"] for r in run],
+        "wifi": [r["host"] - r["ts-s"] for r in run],
+        "end to end": [r["host"] - r["ts-a"] for r in run],
+    }
+    for name in ("serial", "wifi", "end to end"):
+        base = min(series[name])
+        series[name] = [value - base for value in series[name]]
+    return series
+
+
+def jitter(latencies):
+    return [abs(b - a) for a, b in zip(latencies, latencies[1:])]
+
+
+def histogram(values, title):
+    """Prints a histogram with power of two buckets: 0, 1, 2-3, 4-7, ..."""
+    print("  %s (n=%d)" % (title, len(values)))
+    if not values:
+        return
+    buckets = {}
+    for value in values:
+        bucket = value.bit_length() if value > 0 else 0
+        buckets[bucket] = buckets.get(bucket, 0) + 1
+    peak = max(buckets.values())
+    for bucket in range(max(buckets) + 1):
+        count = buckets.get(bucket, 0)
+        low = 0 if bucket == 0 else 1 << (bucket - 1)
+        high = 0 if bucket == 0 else (1 << bucket) - 1
+        label = "%d" % low if low == high else "%d-%d" % (low, high)
+        bar = "#" * (count * 40 // peak) if count else ""
+        print("    %10s ms %7d %s" % (label, count, bar))
+    ordered = sorted(values)
+    print("    p50=%d p90=%d p99=%d max=%d" % (
+        ordered[len(ordered) // 2],
+        ordered[len(ordered) * 9 // 10],
+        ordered[min(len(ordered) - 1, len(ordered) * 99 // 100)],
+        ordered[-1]))
+
+
+def analyze(path):
+    records = load(path)
+    if not records:
+        print("no traced messages in %s" % path)
+        return 1
+    runs = split_restarts(records)
+    print("%d traced messages, %d Arduino run(s)" % (len(records), len(runs)))
+    series = {}
+    for run in runs:
+        lost, reorders, duplicates = sequence_stats(run)
+        seqs = [record["seq"] for record in run]
+        print("run seq %d-%d: %d received, %d lost, %d reordered, %d duplicated" % (
+            min(seqs), max(seqs), len(run), lost, reorders, duplicates))
+        for name, values in hops(run).items():
+            entry = series.setdefault(name, ([], []))
+            entry[0].extend(values)
+            entry[1].extend(jitter(values))
+    for name in ("serial", "esp queue", "wifi", "end to end"):
+        latency, variation = series[name]
+        print("")
+        print("%s" % name)
+        histogram(latency, "latency")
+        histogram(variation, "jitter")
+    return 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    commands = parser.add_subparsers(dest="command")
+    capture_parser = commands.add_parser("capture", help="record messages as Scratch would receive them")
+    capture_parser.add_argument("log")
+    capture_parser.add_argument("--port", type=int, default=SCRATCH_PORT)
+    analyze_parser = commands.add_parser("analyze", help="report loss, latency and jitter per hop")
+    analyze_parser.add_argument("log")
+    args = parser.parse_args()
+    if args.command == "capture":
+        capture(args.log, args.port)
+        return 0
+    if args.command == "analyze":
+        return analyze(args.log)
+    parser.print_help()
+    return 2
+
+
+if __name__ == "__main__":
+    sys.exit(main())